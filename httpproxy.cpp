@@ -1,775 +1,1516 @@
-/*
-
-Tom Flanagan
-
-To Compile: g++ a1.cpp -Wall -o proxy
-
-To Run: ./proxy -p PORT -v DEBUG
-
-The server will listen on port PORT (or 1234 if not specified).
-
-DEBUG=0 only error messages will be printed
-DEBUG=1 connection messages and URLs retrieved will be printed (default)
-DEBUG=2 all data going through the proxy will be printed
-DEBUG=3 even more debug info
-
-This proxy supports multiple concurrent *HTTP/1.1* client connections
-with keep-alive and pipelining. This proxy will block banned words
-in the URL and content with the appropriate 302 redirect method.
-If the client requests an error page with an "If-Modified-Since" header,
-the proxy will automatically respond with 304 Not Modified without asking
-the server.
-
-*/
-
-#include <stdlib.h>
-#include <stdio.h>
-#include <unistd.h>
-
-#include <sstream>
-#include <string>
-#include <vector>
-#include <map>
-
-#ifdef WIN32
-    #include <winsock.h>
-    #typedef socklen_t int
-#else
-    #include <sys/socket.h>
-    #include <arpa/inet.h>
-    #include <netdb.h>
-#endif
-
-#define PORT 1234
-
-#define SIZE (102400) // 100kb buffer
-
-using namespace std;
-
-char buffer[SIZE];
-int debug = 1;
-
-char* BANNED[]  = { "Sponge Bob",
-                    "SpongeBob",
-                    "Barry Manilow",
-                    "Edmonton Oilers",
-                    "BarryManilow",
-                    "EdmontonOilers"
-                    "Sponge%20Bob",
-                    "Barry%20Manilow",
-                    "Edmonton%20Oilers"
-                  };
-
-char* BADURL        = "Sorry, but the Web page that you were trying\
- to access is inappropriate for you, based on the URL. The page has\
- been blocked to avoid insulting your intelligence. \r\nNet Ninny";
-
-char* BADCONTENT    = "Sorry, but the Web page that you were trying\
- to access is inappropriate for you, based on some of the words it \
- contains. The page has been blocked to avoid insulting your intell\
- igence. \r\nNet Ninny";
-
-char* ERROR1URL = "http://pages.cpsc.ucalgary.ca/~carey/CPSC441/ass1/error1.html";
-char* ERROR2URL = "http://pages.cpsc.ucalgary.ca/~carey/CPSC441/ass1/error2.html";
-
-
-
-// fatal error. prints an error message and quits the program
-void error(char* msg)
-{
-    printf("\nFatal Error: %s\n", msg);
-    exit(1);
-}
-
-
-// helper to convert things to std::strings
-template <typename T> string tostring(T x) {
-    stringstream ss;
-    ss << x;
-    return ss.str();
-}
-
-int strfind(string data, string needle)
-{
-    if (data.length()<needle.length()) return 0;
-    for (size_t i=0;i<data.length()-needle.length();i++)
-    {
-        size_t k;
-        for (k=0;k<needle.length();k++)
-        {
-            if ((data[i+k]|32) != (needle[k]|32)) break;
-        }
-        if (k==needle.length()) return 1;
-    }
-    return 0;
-}
-
-string tolower(string data)
-{
-    string dat2;
-    for (size_t i=0;i<data.length();i++)
-    {
-        dat2 += data[i]|32;
-    }
-    return dat2;
-}
-
-
-// parses urls. "protocol://host/path"
-class urltype
-{
-  public:
-    int type;
-    string protocol;
-    string host;
-    string path;
-
-    urltype(){}
-    urltype(string url) { parse(url); }
-
-    // parses a url
-    void parse(string url)
-    {
-        size_t i = url.find("://");
-        if (i!=string::npos)
-        {
-            type = 1;
-            protocol = url.substr(0,i);
-            url.erase(0, i+3);
-        }
-        else
-        {
-            type = 2;
-            protocol = "http";
-        }
-
-        i = url.find("/");
-        if (i==string::npos)
-        {
-            host = url;
-            path = "";
-        }
-        else
-        {
-            host = url.substr(0, i);
-            path = url.substr(i);
-        }
-    }
-
-    // returns the string representation of this url
-    string render()
-    {
-        if (type==1) return protocol + "://" + host + path;
-        else         return path;
-    }
-
-
-};
-
-
-// generic class representing an HTTP message
-class httpmessage
-{
-  private:
-    string buff;
-
-  public:
-    virtual ~httpmessage() {}
-
-    int type;
-    int status;
-    string http;
-    map<string,string> header;
-    string data;
-
-    httpmessage()
-    {
-        type    = 0;
-        status  = 0;
-        http    = "HTTP/1.1";
-    }
-
-    int read(char* data, int n)
-    {
-        string d;
-        d.append(data, n);
-        return read(d);
-    }
-
-    // parses some data into the message. returns the number of bytes that were used
-    int read(string data)
-    {
-        if (debug>= 3) printf("D: status=%d read: %s\nD.\n", status, data.c_str());
-        buff += data;
-
-        size_t i;
-        while ((i=buff.find("\r\n")) != string::npos && (status == 0 || status == 1))
-        {
-            readline(buff.substr(0, i));
-            buff = buff.substr(i+2);
-        }
-
-        if (status == 2)
-        { // How do we know when we are done getting data?
-            string cl("Content-Length");
-            this->data += buff;
-            buff.erase();
-
-            if (header.count(cl))
-            { // 1. if there is a C-L header, do what it says.
-                size_t clv = (size_t)atoi(header[cl].c_str());
-                if (clv == this->data.length())
-                {
-                    status = 3;
-                }
-                if (clv < this->data.length())
-                {
-                    status = 3;
-                    buff = this->data.substr(clv); // return unused bytes
-                    this->data = this->data.substr(0,clv);
-                    return data.length()-buff.length();
-                }
-            }
-            else
-            { // No header. what to do?!?
-                if (type==1)
-                { // this is a request. assume that there is no content.
-                    status = 3;
-                    buff = this->data;
-                    this->data.erase();
-                    return data.length()-buff.length(); // hope this is positive..
-                }
-                if (type==2)
-                { // this is a response. is there a Connection header?
-                    string cn("Connection");
-                                             // google sends capitalized headers :(
-                    if (!header.count(cn) || (tolower(header[cn]) != "close"))
-                    { // there is no connection header, or it's not going to close.
-                      // assume we have everything.
-                        status = 3;
-                        return data.length();
-                    }
-                    // else, the connection will close when we are done.
-                    // let close() handle it.
-                }
-            }
-        }
-
-        return data.length();
-    }
-
-    // peer closed the connection. determine if we are done, or there was an error
-    void close()
-    {
-        if (status == 3)
-            return;
-
-        if (status != 2)
-        {
-            status = -1;
-            return;
-        }
-
-        if (!header.count("Content-Length"))
-        {
-            status = 3;
-            return;
-        }
-        printf("error: peer prematurely closed connection: Content-Length: %s, data=%d\n",
-            header["Content-Length"].c_str(), data.length());
-        status = -1;
-    }
-
-    // parses a single line
-    void readline(string line)
-    {
-        switch (status)
-        {
-            case 0: readfirst(line);
-                    break;
-
-            case 1: readheader(line);
-                    break;
-        }
-    }
-
-    // read the first line. this is different for requests and responses
-    virtual void readfirst(string) = 0;
-
-    // read a header line
-    void readheader(string line)
-    {
-        if (line == "")
-        {
-            status = 2;
-            return;
-        }
-        size_t i = line.find(": ");
-        if (i == string::npos)
-        {
-            i = line.find(":"); // rad.msn.com forgets the space in one of their headers :(
-            if (i == string::npos)
-            {
-                printf("error: invalid header '%s'\n", line.c_str());
-                status = -1;
-                return;
-            }
-            header[line.substr(0,i)] = line.substr(i+1);
-        }
-        else
-            header[line.substr(0,i)] = line.substr(i+2);
-
-    }
-
-
-    virtual void print()
-    {
-        printf("status=%d\n", status);
-        for (map<string,string>::iterator i=header.begin();i!=header.end();i++)
-            printf("header: %s: %s\n", i->first.c_str(), i->second.c_str());
-        printf("data=%s\n", data.c_str());
-    }
-
-    // return the HTTP message in its natural form
-    virtual string render()
-    {
-        string r;
-        r += renderfirst() + "\r\n";
-        for (map<string,string>::iterator i=header.begin();i!=header.end();i++)
-            r += i->first + ": " + i->second + "\r\n";
-        r += "\r\n";
-        r += data;
-
-        return r;
-    }
-
-    virtual string renderfirst() = 0;
-
-};
-
-// HTTP request object
-class httprequest: public httpmessage
-{
-  public:
-    virtual ~httprequest() {}
-
-    string  method;
-    urltype url;
-
-    httprequest() : httpmessage()
-    {
-        type   = 1;
-        status = 0;
-    }
-
-    // parse the first line. "METHOD URL PROTOCOL", ie "GET /index.html HTTP/1.1"
-    void readfirst(string line)
-    {
-        size_t i = line.find(" ");
-        if (i == string::npos)
-        {
-            printf("error: no method\n");
-            status = -1;
-            return;
-        }
-        method = line.substr(0, i);
-        line.erase(0, i+1);
-
-        i = line.find(" ");
-        if (i == string::npos)
-        {
-            printf("error: no url\n");
-            status = -1;
-            return;
-        }
-        url.parse(line.substr(0, i));
-        http = line.substr(i+1);
-
-        if (http != "HTTP/1.0" && http != "HTTP/1.1")
-        {
-            printf("error: invalid http version\n");
-            status = -1;
-            return;
-        }
-
-        status = 1;
-    }
-
-
-    void print()
-    {
-        printf("httprequest\n");
-        printf("method=%s, url=%s, http=%s\n", method.c_str(), url.render().c_str(), http.c_str());
-        httpmessage::print();
-    }
-
-    string renderfirst()
-    {
-        string r;
-        r += method + " " + url.render() + " " + http;
-        return r;
-    }
-
-};
-
-// HTTP response object
-class httpresponse: public httpmessage
-{
-
-  public:
-    virtual ~httpresponse(){}
-    string code;
-    string reason;
-
-    httpresponse():httpmessage()
-    {
-        type    = 2;
-        code    = "200";
-        reason  = "OK";
-    }
-
-    // parse the first line. ie: "HTTP/1.1 200 OK"
-    void readfirst(string line)
-    {
-        size_t i = line.find(" ");
-        if (i == string::npos)
-        {
-            printf("error: no http\n");
-            status = -1;
-            return;
-        }
-        http = line.substr(0, i);
-        line.erase(0, i+1);
-
-        i = line.find(" ");
-        if (i == string::npos)
-        {
-            printf("error: no response code\n");
-            status = -1;
-            return;
-        }
-        code = line.substr(0, i);
-        reason = line.substr(i+1);
-
-        if (http != "HTTP/1.0" && http != "HTTP/1.1")
-        {
-            printf("error: invalid http: %s\n", http.c_str());
-            status = -1;
-            return;
-        }
-
-        status = 1;
-    }
-
-    string renderfirst()
-    {
-        string r;
-        r += http + " " + code + " " + reason;
-        return r;
-    }
-
-};
-
-
-
-// handles a single client connection to the proxy
-class proxyhandler
-{
-
-  public:
-
-    int         sock;
-    sockaddr_in addr;
-
-
-    proxyhandler(int s, sockaddr_in a)
-    {
-        sock = s;
-        addr = a;
-    }
-
-    ~proxyhandler()
-    {
-        close(sock);
-    }
-
-    // keep processing requests until the client disconnects
-    void main()
-    {
-        int requests = 0;
-        if (debug) printf("Processing connection from %s:%d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-        //process();
-        while (process() != -1) requests++;
-        if (debug) printf("Finished connection from %s:%d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-        if (debug) printf("Served %d requests to the client\n", requests);
-    }
-
-    // read a single request from the client, and serve the appropriate response
-    int process()
-    {
-        httprequest     req;
-        httpresponse    res;
-
-        if (recv(sock, req) == -1)
-        {  // client disconnected
-            return -1;
-        }
-        if (debug>=2) printf("CLIENT->PROXY:\n\n%s\n\n", req.render().c_str());
-
-        if (debug>=1) printf("  CLIENT: %s\n", req.url.render().c_str());
-        int r = load(req,  res);
-
-        res.header["Proxy-Connection"] = "close";
-        res.header["Connection"] = "close";
-
-        if (r != -1 && req.header["Connection"] == "keep-alive" || req.header["Proxy-Connection"] == "keep-alive")
-        {
-            res.header["Proxy-Connection"] = "keep-alive";
-            res.header["Connection"] = "keep-alive";
-        }
-
-        if (debug>=2) printf("PROXY->CLIENT:\n\n%s\n\n", res.render().c_str());
-        send(sock, res);
-
-        return r;
-    }
-
-    int load(httprequest &req, httpresponse &res)
-    {
-        if (req.status != 3)
-        {
-            res = response(400, "Bad Request", "Error while parsing your browsers request");
-            res.header["Connection"] = "close";
-            return -1; // close the client connection, because buffers might be messed up
-        }
-
-        if (req.url.protocol != "http") // tried to proxy https://, ftp://, etc
-        {
-            res = response(400, "Bad Request", "Only HTTP protocol is supported");
-            return 0;
-        }
-
-        if (banned(req.url.render())) // bad URL
-        {
-            res = response(302, "Page Moved", BADURL);
-            res.header["Location"] = ERROR1URL;
-            return 0;
-        }
-
-        if (req.url.render() == ERROR1URL || req.url.render() == ERROR2URL)
-        {
-            if (req.header.count("If-Modified-Since"))
-            {
-                res = response(304, "Not Modified", "");
-                return 0;
-            }
-        }
-
-        hostent* he = gethostbyname(req.url.host.c_str());
-        if (he == NULL)
-        {
-            res = response(404, "Bad Request", tostring("Host ")+req.url.host+" was not found");
-            return 0;
-        }
-        sockaddr_in servaddr;
-
-        servaddr.sin_family = AF_INET;
-        servaddr.sin_port   = htons(80);
-        servaddr.sin_addr = *((struct in_addr*)he->h_addr);
-        memset(servaddr.sin_zero, '\0', sizeof servaddr.sin_zero);
-
-        int serv = socket(AF_INET, SOCK_STREAM, 0);
-        if (connect(serv, (struct sockaddr *)&servaddr, sizeof servaddr) == -1)
-        {
-            res = response(504, "Could Not Connect", tostring("Could not connect to remote server ") + req.url.host);
-            return 0;
-        }
-
-        map<string,string> temp = req.header;
-        req.header["Connection"] = "close"; // HTTP/1.1 doesn't quite work on the client side
-        req.url.type = 2;
-
-        if (debug>=2) printf("PROXY->SERV:\n\n%s\n\n", req.render().c_str());
-        if (send(serv, req) == -1)
-        {
-            res = response(502, "Server Error", "Error sending request to remote server");
-            return 0;
-        }
-        if (recv(serv, res) == -1)
-        {
-            //printf("SERV->PROXY (recv error):\n\n%s\n\n", res.render().c_str());
-            res = response(502, "Server Error", "Error reading response from remote server");
-            return 0;
-        }
-
-        if (debug>=2) printf("SERV->PROXY (good) (%d bytes):\n\n%s\n\n", res.data.length(), res.render().c_str());
-        close(serv);
-
-        req.header = temp;
-
-        if (banned(res.data)) // bad content
-        {
-            res = response(302, "Page Moved", BADCONTENT);
-            res.header["Location"] = ERROR2URL;
-            return 0;
-        }
-
-        if (!res.header.count("Content-Length")) // the server might not have sent a C-L header, but we need one so the client can read >1 responses.
-            res.header["Content-Length"] = tostring(res.data.length());
-
-        else if (atoi(res.header["Content-Length"].c_str()) != (int)res.data.length())
-                error("content-length mismatch"); // this should never happen, httpmessage checks it
-
-
-        return 0;
-    }
-
-    // create a custom message
-    httpresponse response(int code, string reason, string data)
-    {
-        httpresponse res;
-        res.http    = "HTTP/1.1";
-        res.code    = tostring(code);
-        res.reason  = reason;
-        res.data    = data;
-        res.header["Content-Length"] = tostring(res.data.length());
-        res.header["Content-Type"] = "text/plain";
-        return res;
-    }
-
-    // recv an httpmessage from a socket. returns -1 on failure, bytes read on success
-    int recv(int sock, httpmessage &msg)
-    {
-        int bytes = 0;
-        while (msg.status != 3 && msg.status != -1)
-        {   // peek - we might not want all of the bytes here, as some may be for a future pipelined message, and not this message.
-            int r = ::recv(sock, buffer, SIZE, MSG_PEEK);
-            if (debug>= 3) printf("got %d bytes\n", r);
-            if (r == -1)
-            {
-                error("recv");
-                return -1;
-            }
-
-            if (r==0)
-            { // peer closed the connection
-                msg.close();
-                if (debug>= 3) printf("peer closed connection. status=%d\n", msg.status);
-                if (msg.status == -1)   return -1;
-                else                    return bytes;
-            }
-
-            int rr = msg.read(buffer, r);
-            if (debug>= 3) printf("httpmessage (status=%d) wanted %d bytes\n", msg.status, rr);
-            if (rr != ::recv(sock, buffer, rr, 0))
-            {   // clear the buffer of bytes we acctually wanted
-                error("error reading socket");
-            }
-            bytes += rr;
-        }
-        return msg.status==-1 ? -1 : bytes;
-    }
-
-    // send an httpmessage to a socket. returns -1 on failure, number of bytes send on success
-    int send(int sock, httpmessage &msg)
-    {
-        string buff = msg.render();
-        int i       = 0;
-        int j       = buff.length();
-
-        while (i != j && i != -1)
-        {
-            i += ::send(sock, buff.c_str()+i, j-i, 0);
-        }
-        return i;
-    }
-
-    int banned(string data)
-    {
-        for (unsigned int i=0;i<sizeof(BANNED)/sizeof(char*);i++)
-        {
-            if (strfind(data, BANNED[i]))
-            {
-                if (debug) printf("FOUND: %s\n", BANNED[i]);
-                return 1;
-            }
-        }
-        return 0;
-    }
-
-};
-
-
-// proxy main. listen for and accept new requests, forking off to a proxyhandler object.
-int main(int argv, char**argc)
-{
-    int port = PORT;
-
-    vector<string> args;
-    for (int i=1;i<argv;i++)
-        args.push_back(argc[i]);
-
-    while (args.size() >= 2)
-    {
-        if (args[0] == "-p")
-        {
-            port = atoi(args[1].c_str());
-            args.erase(args.begin(),args.begin()+2);
-        }
-        else if (args[0] == "-v")
-        {
-            debug = atoi(args[1].c_str());
-            args.erase(args.begin(),args.begin()+2);
-        }
-        else
-        {
-            printf("'%s' invalid parameter\n", args[0].c_str());
-            args.erase(args.begin());
-        }
-
-    }
-
-    printf("HTTP Proxy listening on port %d\n", port);
-
-    int                 listener;
-    struct sockaddr_in  addr;
-
-    addr.sin_family = AF_INET;
-    addr.sin_port   = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    memset(addr.sin_zero, '\0', sizeof addr.sin_zero);
-
-    listener = socket(AF_INET, SOCK_STREAM, 0);
-
-    if (listener == -1)
-        error("create socket");
-
-    if (bind(listener, (struct sockaddr *)&addr, sizeof addr) == -1)
-        error("bind");
-
-    if (listen(listener, 10) == -1)
-        error("listen");
-
-    while (1)
-    {
-        socklen_t size;
-        struct sockaddr_in newaddr;
-
-        int newsock = accept(listener, (struct sockaddr *)&newaddr, &size);
-        if (newsock == -1)
-            error("accept");
-
-        if (debug) printf("connection from %s\n", inet_ntoa(newaddr.sin_addr));
-
-        if (!fork())
-        {
-            close(listener);
-            proxyhandler px(newsock, newaddr);
-            px.main();
-            return 0;
-        }
-        close(newsock);
-    }
-
-    return 0;
-}
+/*
+
+Tom Flanagan
+
+To Compile: g++ httpproxy.cpp -Wall -O2 -o proxy
+
+To Run: ./proxy -p PORT -v DEBUG -m MODE -w WORKERS -a AFFINITY -b BACKLOG
+
+The server will listen on port PORT (or 1234 if not specified).
+
+MODE=epoll all connections are handled by one process with an epoll event loop (default)
+MODE=fork  a new process is forked for every client connection
+
+WORKERS>1 starts that many worker processes. each one has its own SO_REUSEPORT
+listener and event loop, so accepting and serving is spread over the cores.
+AFFINITY=1 pins each worker to its own cpu. BACKLOG is the listen() queue
+length (default 511).
+
+Connections to servers are kept alive and reused by later requests:
+  -pool-idle N      at most N idle server connections (default 256, 0 = off)
+  -pool-host N      at most N idle connections per host:port (default 8)
+  -pool-timeout N   close idle server connections after N seconds (default 30)
+
+DEBUG=0 only error messages will be printed
+DEBUG=1 connection messages and URLs retrieved will be printed (default)
+DEBUG=2 all data going through the proxy will be printed
+DEBUG=3 even more debug info
+
+This proxy supports multiple concurrent *HTTP/1.1* client connections
+with keep-alive and pipelining. This proxy will block banned words
+in the URL and content with the appropriate 302 redirect method.
+If the client requests an error page with an "If-Modified-Since" header,
+the proxy will automatically respond with 304 Not Modified without asking
+the server.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+
+#ifdef WIN32
+    #include <winsock.h>
+    #typedef socklen_t int
+#else
+    #include <sys/socket.h>
+    #include <arpa/inet.h>
+    #include <netdb.h>
+    #include <sys/epoll.h>
+    #include <sys/wait.h>
+    #include <sys/prctl.h>
+    #include <sched.h>
+#endif
+
+#define PORT 1234
+
+#define SIZE (102400) // 100kb buffer
+
+using namespace std;
+
+char buffer[SIZE];
+int debug = 1;
+
+char* BANNED[]  = { "Sponge Bob",
+                    "SpongeBob",
+                    "Barry Manilow",
+                    "Edmonton Oilers",
+                    "BarryManilow",
+                    "EdmontonOilers"
+                    "Sponge%20Bob",
+                    "Barry%20Manilow",
+                    "Edmonton%20Oilers"
+                  };
+
+char* BADURL        = "Sorry, but the Web page that you were trying\
+ to access is inappropriate for you, based on the URL. The page has\
+ been blocked to avoid insulting your intelligence. \r\nNet Ninny";
+
+char* BADCONTENT    = "Sorry, but the Web page that you were trying\
+ to access is inappropriate for you, based on some of the words it \
+ contains. The page has been blocked to avoid insulting your intell\
+ igence. \r\nNet Ninny";
+
+char* ERROR1URL = "http://pages.cpsc.ucalgary.ca/~carey/CPSC441/ass1/error1.html";
+char* ERROR2URL = "http://pages.cpsc.ucalgary.ca/~carey/CPSC441/ass1/error2.html";
+
+
+
+// fatal error. prints an error message and quits the program
+void error(char* msg)
+{
+    printf("\nFatal Error: %s\n", msg);
+    exit(1);
+}
+
+
+// helper to convert things to std::strings
+template <typename T> string tostring(T x) {
+    stringstream ss;
+    ss << x;
+    return ss.str();
+}
+
+int strfind(string data, string needle)
+{
+    if (data.length()<needle.length()) return 0;
+    for (size_t i=0;i<data.length()-needle.length();i++)
+    {
+        size_t k;
+        for (k=0;k<needle.length();k++)
+        {
+            if ((data[i+k]|32) != (needle[k]|32)) break;
+        }
+        if (k==needle.length()) return 1;
+    }
+    return 0;
+}
+
+string tolower(string data)
+{
+    string dat2;
+    for (size_t i=0;i<data.length();i++)
+    {
+        dat2 += data[i]|32;
+    }
+    return dat2;
+}
+
+
+// parses urls. "protocol://host/path"
+class urltype
+{
+  public:
+    int type;
+    string protocol;
+    string host;        // as it appears in the url, maybe with a :port
+    string hostname;    // host without the port
+    int    port;
+    string path;
+
+    urltype(){}
+    urltype(string url) { parse(url); }
+
+    // parses a url
+    void parse(string url)
+    {
+        size_t i = url.find("://");
+        if (i!=string::npos)
+        {
+            type = 1;
+            protocol = url.substr(0,i);
+            url.erase(0, i+3);
+        }
+        else
+        {
+            type = 2;
+            protocol = "http";
+        }
+
+        i = url.find("/");
+        if (i==string::npos)
+        {
+            host = url;
+            path = "";
+        }
+        else
+        {
+            host = url.substr(0, i);
+            path = url.substr(i);
+        }
+
+        hostname = host;
+        port     = 80;
+        i = host.rfind(":");
+        if (i!=string::npos)
+        {
+            hostname = host.substr(0, i);
+            port     = atoi(host.substr(i+1).c_str());
+        }
+    }
+
+    // returns the string representation of this url
+    string render()
+    {
+        if (type==1) return protocol + "://" + host + path;
+        else         return path;
+    }
+
+
+};
+
+
+// generic class representing an HTTP message
+class httpmessage
+{
+  private:
+    string buff;
+
+  public:
+    virtual ~httpmessage() {}
+
+    int type;
+    int status;
+    string http;
+    map<string,string> header;
+    string data;
+
+    httpmessage()
+    {
+        type    = 0;
+        status  = 0;
+        http    = "HTTP/1.1";
+    }
+
+    int read(char* data, int n)
+    {
+        string d;
+        d.append(data, n);
+        return read(d);
+    }
+
+    // parses some data into the message. returns the number of bytes that were used
+    int read(string data)
+    {
+        if (debug>= 3) printf("D: status=%d read: %s\nD.\n", status, data.c_str());
+        buff += data;
+
+        size_t i;
+        while ((i=buff.find("\r\n")) != string::npos && (status == 0 || status == 1))
+        {
+            readline(buff.substr(0, i));
+            buff = buff.substr(i+2);
+        }
+
+        if (status == 2 && bodyless())
+        { // this message never has a body, whatever the headers say
+            status = 3;
+            return data.length()-buff.length();
+        }
+
+        if (status == 2)
+        { // How do we know when we are done getting data?
+            string cl("Content-Length");
+            this->data += buff;
+            buff.erase();
+
+            if (header.count(cl))
+            { // 1. if there is a C-L header, do what it says.
+                size_t clv = (size_t)atoi(header[cl].c_str());
+                if (clv == this->data.length())
+                {
+                    status = 3;
+                }
+                if (clv < this->data.length())
+                {
+                    status = 3;
+                    buff = this->data.substr(clv); // return unused bytes
+                    this->data = this->data.substr(0,clv);
+                    return data.length()-buff.length();
+                }
+            }
+            else
+            { // No header. what to do?!?
+                if (type==1)
+                { // this is a request. assume that there is no content.
+                    status = 3;
+                    buff = this->data;
+                    this->data.erase();
+                    return data.length()-buff.length(); // hope this is positive..
+                }
+                if (type==2)
+                { // this is a response. is there a Connection header?
+                    string cn("Connection");
+                                             // google sends capitalized headers :(
+                    if (!header.count(cn) || (tolower(header[cn]) != "close"))
+                    { // there is no connection header, or it's not going to close.
+                      // assume we have everything.
+                        status = 3;
+                        return data.length();
+                    }
+                    // else, the connection will close when we are done.
+                    // let close() handle it.
+                }
+            }
+        }
+
+        return data.length();
+    }
+
+    // peer closed the connection. determine if we are done, or there was an error
+    void close()
+    {
+        if (status == 3)
+            return;
+
+        if (status != 2)
+        {
+            status = -1;
+            return;
+        }
+
+        if (!header.count("Content-Length"))
+        {
+            status = 3;
+            return;
+        }
+        printf("error: peer prematurely closed connection: Content-Length: %s, data=%d\n",
+            header["Content-Length"].c_str(), data.length());
+        status = -1;
+    }
+
+    // parses a single line
+    void readline(string line)
+    {
+        switch (status)
+        {
+            case 0: readfirst(line);
+                    break;
+
+            case 1: readheader(line);
+                    break;
+        }
+    }
+
+    // read the first line. this is different for requests and responses
+    virtual void readfirst(string) = 0;
+
+    // true if the message ends with the headers
+    virtual int bodyless() { return 0; }
+
+    // read a header line
+    void readheader(string line)
+    {
+        if (line == "")
+        {
+            status = 2;
+            return;
+        }
+        size_t i = line.find(": ");
+        if (i == string::npos)
+        {
+            i = line.find(":"); // rad.msn.com forgets the space in one of their headers :(
+            if (i == string::npos)
+            {
+                printf("error: invalid header '%s'\n", line.c_str());
+                status = -1;
+                return;
+            }
+            header[line.substr(0,i)] = line.substr(i+1);
+        }
+        else
+            header[line.substr(0,i)] = line.substr(i+2);
+
+    }
+
+
+    virtual void print()
+    {
+        printf("status=%d\n", status);
+        for (map<string,string>::iterator i=header.begin();i!=header.end();i++)
+            printf("header: %s: %s\n", i->first.c_str(), i->second.c_str());
+        printf("data=%s\n", data.c_str());
+    }
+
+    // return the HTTP message in its natural form
+    virtual string render()
+    {
+        string r;
+        r += renderfirst() + "\r\n";
+        for (map<string,string>::iterator i=header.begin();i!=header.end();i++)
+            r += i->first + ": " + i->second + "\r\n";
+        r += "\r\n";
+        r += data;
+
+        return r;
+    }
+
+    virtual string renderfirst() = 0;
+
+};
+
+// HTTP request object
+class httprequest: public httpmessage
+{
+  public:
+    virtual ~httprequest() {}
+
+    string  method;
+    urltype url;
+
+    httprequest() : httpmessage()
+    {
+        type   = 1;
+        status = 0;
+    }
+
+    // parse the first line. "METHOD URL PROTOCOL", ie "GET /index.html HTTP/1.1"
+    void readfirst(string line)
+    {
+        size_t i = line.find(" ");
+        if (i == string::npos)
+        {
+            printf("error: no method\n");
+            status = -1;
+            return;
+        }
+        method = line.substr(0, i);
+        line.erase(0, i+1);
+
+        i = line.find(" ");
+        if (i == string::npos)
+        {
+            printf("error: no url\n");
+            status = -1;
+            return;
+        }
+        url.parse(line.substr(0, i));
+        http = line.substr(i+1);
+
+        if (http != "HTTP/1.0" && http != "HTTP/1.1")
+        {
+            printf("error: invalid http version\n");
+            status = -1;
+            return;
+        }
+
+        status = 1;
+    }
+
+
+    void print()
+    {
+        printf("httprequest\n");
+        printf("method=%s, url=%s, http=%s\n", method.c_str(), url.render().c_str(), http.c_str());
+        httpmessage::print();
+    }
+
+    string renderfirst()
+    {
+        string r;
+        r += method + " " + url.render() + " " + http;
+        return r;
+    }
+
+};
+
+// HTTP response object
+class httpresponse: public httpmessage
+{
+
+  public:
+    virtual ~httpresponse(){}
+    string code;
+    string reason;
+    int    head;    // this is the response to a HEAD request
+
+    httpresponse():httpmessage()
+    {
+        type    = 2;
+        code    = "200";
+        reason  = "OK";
+        head    = 0;
+    }
+
+    // responses to HEAD, 1xx, 204 and 304 don't have a body
+    int bodyless()
+    {
+        return head || code[0] == '1' || code == "204" || code == "304";
+    }
+
+    // parse the first line. ie: "HTTP/1.1 200 OK"
+    void readfirst(string line)
+    {
+        size_t i = line.find(" ");
+        if (i == string::npos)
+        {
+            printf("error: no http\n");
+            status = -1;
+            return;
+        }
+        http = line.substr(0, i);
+        line.erase(0, i+1);
+
+        i = line.find(" ");
+        if (i == string::npos)
+        {
+            printf("error: no response code\n");
+            status = -1;
+            return;
+        }
+        code = line.substr(0, i);
+        reason = line.substr(i+1);
+
+        if (http != "HTTP/1.0" && http != "HTTP/1.1")
+        {
+            printf("error: invalid http: %s\n", http.c_str());
+            status = -1;
+            return;
+        }
+
+        status = 1;
+    }
+
+    string renderfirst()
+    {
+        string r;
+        r += http + " " + code + " " + reason;
+        return r;
+    }
+
+};
+
+
+
+// put a socket into non-blocking mode
+int nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+// something that wants to be told about events on a file descriptor
+class iohandler
+{
+  public:
+    virtual ~iohandler() {}
+
+    // called by the eventloop when fd has events (EPOLLIN, EPOLLOUT, EPOLLERR, ...)
+    virtual void event(int fd, unsigned int events) = 0;
+};
+
+
+// an edge-triggered epoll event loop. there is one of these per process.
+class eventloop
+{
+  public:
+    int                 epfd;
+    int                 connections;    // number of live client connections
+    vector<iohandler*>  handlers;       // indexed by fd
+    vector<iohandler*>  dead;           // deleted once the current batch of events is dispatched
+
+    eventloop()
+    {
+        connections = 0;
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd == -1)
+            error("epoll_create");
+    }
+
+    ~eventloop()
+    {
+        ::close(epfd);
+    }
+
+    // start watching fd. this is edge-triggered, so the handler has to
+    // read/write until EAGAIN or it won't hear about the fd again.
+    void add(int fd, iohandler* h)
+    {
+        epoll_event ev;
+        ev.events  = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            error("epoll_ctl");
+        if ((size_t)fd >= handlers.size())
+            handlers.resize(fd+1, NULL);
+        handlers[fd] = h;
+    }
+
+    // stop watching fd. call this before closing it
+    void remove(int fd)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        if ((size_t)fd < handlers.size())
+            handlers[fd] = NULL;
+    }
+
+    // delete h after the current batch; there may still be events queued for it
+    void destroy(iohandler* h)
+    {
+        dead.push_back(h);
+    }
+
+    // wait up to timeout ms (-1 = forever) for events, and dispatch them
+    void once(int timeout)
+    {
+        epoll_event events[256];
+        int n = epoll_wait(epfd, events, 256, timeout);
+        if (n == -1)
+        {
+            if (errno == EINTR) return;
+            error("epoll_wait");
+        }
+
+        for (int i=0;i<n;i++)
+        {
+            int fd = events[i].data.fd;
+            if ((size_t)fd < handlers.size() && handlers[fd])
+                handlers[fd]->event(fd, events[i].events);
+        }
+
+        for (size_t i=0;i<dead.size();i++)
+            delete dead[i];
+        dead.clear();
+    }
+};
+
+
+// idle keep-alive connections to servers, kept around so later requests to
+// the same host:port can skip the TCP handshake.
+class connpool
+{
+  public:
+    struct idleconn
+    {
+        int     fd;
+        time_t  since;  // when it went idle
+    };
+
+    map<string, deque<idleconn> > idle; // "host:port" -> connections, most recently used last
+    int     count;      // idle connections in total
+
+    int     maxidle;    // limits. 0 maxidle turns the pool off
+    int     maxperhost;
+    int     timeout;    // seconds a connection may sit idle
+
+    long    hits;       // counters
+    long    misses;
+    long    stale;      // pooled connections that turned out to be dead
+
+    connpool()
+    {
+        count       = 0;
+        maxidle     = 256;
+        maxperhost  = 8;
+        timeout     = 30;
+        hits        = 0;
+        misses      = 0;
+        stale       = 0;
+    }
+
+    // take an idle connection to key, or -1 if there isn't a good one
+    int get(string key)
+    {
+        map<string, deque<idleconn> >::iterator i = idle.find(key);
+        while (i != idle.end() && !i->second.empty())
+        {
+            idleconn c = i->second.back();
+            i->second.pop_back();
+            count--;
+            if (i->second.empty())
+                idle.erase(i);
+
+            if (healthy(c))
+            {
+                hits++;
+                if (debug>=2) printf("pool: reusing connection to %s (hits=%ld, misses=%ld)\n", key.c_str(), hits, misses);
+                return c.fd;
+            }
+            stale++;
+            close(c.fd);
+            i = idle.find(key);
+        }
+        misses++;
+        return -1;
+    }
+
+    // give back a connection that finished a response and can take another request
+    void put(string key, int fd)
+    {
+        deque<idleconn>& q = idle[key];
+        if (count >= maxidle || (int)q.size() >= maxperhost)
+        {
+            if (q.empty()) idle.erase(key);
+            close(fd);
+            return;
+        }
+        idleconn c;
+        c.fd    = fd;
+        c.since = time(NULL);
+        q.push_back(c);
+        count++;
+    }
+
+    // close connections that have been idle for too long
+    void expire()
+    {
+        if (!count) return;
+        time_t now = time(NULL);
+        map<string, deque<idleconn> >::iterator i = idle.begin();
+        while (i != idle.end())
+        {
+            deque<idleconn>& q = i->second;
+            while (!q.empty() && now - q.front().since >= timeout)
+            {
+                close(q.front().fd);
+                q.pop_front();
+                count--;
+            }
+            if (q.empty()) idle.erase(i++);
+            else           i++;
+        }
+    }
+
+    // a connection is good if it hasn't timed out, the server hasn't closed it,
+    // and the server hasn't sent anything we weren't expecting
+    int healthy(idleconn& c)
+    {
+        if (time(NULL) - c.since >= timeout)
+            return 0;
+        char b;
+        int r = ::recv(c.fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+        return r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+};
+
+connpool pool;
+
+
+// handles a single client connection to the proxy.
+// this is a state machine driven by the eventloop, which works both the client
+// socket and the upstream server socket:
+//   READING -> (resolve) -> CONNECTING -> SENDING -> RECEIVING -> WRITING -> READING ...
+// requests that can be answered without the server go straight from READING to WRITING.
+class proxyhandler: public iohandler
+{
+
+  public:
+    enum { READING, CONNECTING, SENDING, RECEIVING, WRITING, CLOSED };
+
+    eventloop&  loop;
+    int         sock;
+    sockaddr_in addr;
+    int         serv;       // upstream server socket, -1 if there isn't one
+    string      servkey;    // "host:port" of serv, for the connection pool
+    int         reused;     // serv came from the connection pool
+    int         servbytes;  // bytes received from serv for this response
+    int         servjunk;   // serv can't be reused (it closed, or sent too much)
+    int         state;
+    int         keepalive;  // 0 if we close the client connection after this response
+    int         requests;
+
+    string      in;         // bytes from the client that haven't been parsed yet
+    string      out;        // bytes waiting to be written to serv (SENDING) or sock (WRITING)
+    size_t      outpos;
+
+    httprequest     req;
+    httpresponse    res;
+
+
+    proxyhandler(eventloop& l, int s, sockaddr_in a) : loop(l)
+    {
+        sock        = s;
+        addr        = a;
+        serv        = -1;
+        reused      = 0;
+        servbytes   = 0;
+        servjunk    = 0;
+        state       = READING;
+        keepalive   = 1;
+        requests    = 0;
+        outpos      = 0;
+
+        if (debug) printf("Processing connection from %s:%d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        nonblocking(sock);
+        loop.connections++;
+        loop.add(sock, this);
+        readclient();
+    }
+
+    ~proxyhandler()
+    {
+    }
+
+    void event(int fd, unsigned int events)
+    {
+        if (fd == sock)
+        {
+            if (state == READING) readclient();
+            if (state == WRITING) writeclient();
+        }
+        else if (fd == serv)
+        {
+            if (state == CONNECTING) connected();
+            if (state == SENDING)    writeserv();
+            if (state == RECEIVING)  readserv();
+        }
+    }
+
+    // the client went away, or we are done with it
+    void finish()
+    {
+        if (state == CLOSED) return;
+        state = CLOSED;
+        closeserv();
+        loop.remove(sock);
+        close(sock);
+        loop.connections--;
+        loop.destroy(this);
+
+        if (debug) printf("Finished connection from %s:%d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        if (debug) printf("Served %d requests to the client\n", requests);
+    }
+
+    void closeserv()
+    {
+        if (serv == -1) return;
+        loop.remove(serv);
+        close(serv);
+        serv = -1;
+    }
+
+    // read from the client until we have a whole request, or the socket is drained
+    void readclient()
+    {
+        while (state == READING)
+        {
+            if (!in.empty())
+            {   // leftover bytes might be a pipelined request
+                int used = req.read(in);
+                in.erase(0, used);
+                if (req.status == 3 || req.status == -1)
+                {
+                    process();
+                    return;
+                }
+            }
+
+            int r = ::recv(sock, buffer, SIZE, 0);
+            if (debug>= 3) printf("got %d bytes\n", r);
+            if (r == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                if (errno == EINTR) continue;
+                printf("error: recv from client: %s\n", strerror(errno));
+                finish();
+                return;
+            }
+            if (r == 0)
+            {   // client disconnected
+                finish();
+                return;
+            }
+            in.append(buffer, r);
+        }
+    }
+
+    // we have read a single request from the client, start serving the appropriate response
+    void process()
+    {
+        if (debug>=2) printf("CLIENT->PROXY:\n\n%s\n\n", req.render().c_str());
+
+        if (debug>=1) printf("  CLIENT: %s\n", req.url.render().c_str());
+        int r = load();
+        if (r == 1)
+            return; // waiting for the server
+        respond(r);
+    }
+
+    // returns 1 if the request went to the server, otherwise res has the response and
+    // load returns 0, or -1 if the client connection must be closed afterwards
+    int load()
+    {
+        if (req.status != 3)
+        {
+            res = response(400, "Bad Request", "Error while parsing your browsers request");
+            res.header["Connection"] = "close";
+            return -1; // close the client connection, because buffers might be messed up
+        }
+
+        if (req.url.protocol != "http") // tried to proxy https://, ftp://, etc
+        {
+            res = response(400, "Bad Request", "Only HTTP protocol is supported");
+            return 0;
+        }
+
+        if (banned(req.url.render())) // bad URL
+        {
+            res = response(302, "Page Moved", BADURL);
+            res.header["Location"] = ERROR1URL;
+            return 0;
+        }
+
+        if (req.url.render() == ERROR1URL || req.url.render() == ERROR2URL)
+        {
+            if (req.header.count("If-Modified-Since"))
+            {
+                res = response(304, "Not Modified", "");
+                return 0;
+            }
+        }
+
+        return fetch(1);
+    }
+
+    // send req to the server, on a pooled connection if usepool and there is one.
+    // returns 1 if the request is on its way, or 0 if res has an error response
+    int fetch(int usepool)
+    {
+        map<string,string> temp = req.header;
+        req.header["Connection"] = "keep-alive";
+        req.header.erase("Proxy-Connection");
+        req.url.type = 2;
+
+        if (debug>=2) printf("PROXY->SERV:\n\n%s\n\n", req.render().c_str());
+        out     = req.render();
+        outpos  = 0;
+        req.header = temp;
+
+        res         = httpresponse();
+        res.head    = req.method == "HEAD";
+        servkey     = req.url.hostname + ":" + tostring(req.url.port);
+        servbytes   = 0;
+        servjunk    = 0;
+        reused      = 0;
+
+        if (usepool && (serv = pool.get(servkey)) != -1)
+        {
+            reused = 1;
+            loop.add(serv, this);
+            state = SENDING;
+            return 1;
+        }
+
+        hostent* he = gethostbyname(req.url.hostname.c_str());
+        if (he == NULL)
+        {
+            res = response(404, "Bad Request", tostring("Host ")+req.url.host+" was not found");
+            return 0;
+        }
+        sockaddr_in servaddr;
+
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_port   = htons(req.url.port);
+        servaddr.sin_addr = *((struct in_addr*)he->h_addr);
+        memset(servaddr.sin_zero, '\0', sizeof servaddr.sin_zero);
+
+        serv = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (serv == -1 || (connect(serv, (struct sockaddr *)&servaddr, sizeof servaddr) == -1 && errno != EINPROGRESS))
+        {
+            if (serv != -1) close(serv);
+            serv = -1;
+            res = response(504, "Could Not Connect", tostring("Could not connect to remote server ") + req.url.host);
+            return 0;
+        }
+        loop.add(serv, this);
+
+        state = CONNECTING;
+        return 1;
+    }
+
+    // the non-blocking connect() to the server finished
+    void connected()
+    {
+        int err = 0;
+        socklen_t len = sizeof err;
+        if (getsockopt(serv, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+            err = errno;
+        if (err == EINPROGRESS)
+            return;
+        if (err)
+        {
+            fail(504, "Could Not Connect", tostring("Could not connect to remote server ") + req.url.host);
+            return;
+        }
+        state = SENDING;
+        writeserv();
+    }
+
+    // send the request to the server
+    void writeserv()
+    {
+        int r = flush(serv);
+        if (r == -1)
+        {
+            if (retry()) return;
+            fail(502, "Server Error", "Error sending request to remote server");
+            return;
+        }
+        if (r == 0) return;
+
+        state = RECEIVING;
+        readserv();
+    }
+
+    // read the response from the server, until it is complete
+    void readserv()
+    {
+        while (state == RECEIVING)
+        {
+            int r = ::recv(serv, buffer, SIZE, 0);
+            if (debug>= 3) printf("got %d bytes\n", r);
+            if (r == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                if (errno == EINTR) continue;
+                res.status = -1;
+            }
+            else if (r == 0)
+            {   // peer closed the connection
+                res.close();
+                servjunk = 1;
+                if (debug>= 3) printf("peer closed connection. status=%d\n", res.status);
+            }
+            else
+            {
+                int rr = res.read(buffer, r);
+                if (debug>= 3) printf("httpmessage (status=%d) wanted %d bytes\n", res.status, rr);
+                servbytes += r;
+                if (rr < r) servjunk = 1; // the server sent more than the response
+            }
+
+            if (res.status == -1)
+            {
+                //printf("SERV->PROXY (recv error):\n\n%s\n\n", res.render().c_str());
+                if (retry()) return;
+                fail(502, "Server Error", "Error reading response from remote server");
+                return;
+            }
+            if (res.status == 3)
+                served();
+        }
+    }
+
+    // a pooled connection can be closed by the server just as we send on it.
+    // if it died before answering, try again once on a fresh connection.
+    int retry()
+    {
+        if (!reused || servbytes)
+            return 0;
+        if (debug>=2) printf("pool: stale connection to %s, retrying\n", servkey.c_str());
+        pool.stale++;
+        closeserv();
+        if (fetch(0))
+            return 1;
+        respond(0);
+        return 1;
+    }
+
+    // can serv take another request after this response?
+    int reusable()
+    {
+        if (servjunk)
+            return 0;
+        string cn = res.header.count("Connection") ? tolower(res.header["Connection"]) : "";
+        if (cn.find("close") != string::npos)
+            return 0;
+        if (res.http != "HTTP/1.1" && cn.find("keep-alive") == string::npos)
+            return 0;
+        return res.bodyless() || res.header.count("Content-Length");
+    }
+
+    // the whole response from the server is in res
+    void served()
+    {
+        if (debug>=2) printf("SERV->PROXY (good) (%d bytes):\n\n%s\n\n", (int)res.data.length(), res.render().c_str());
+        if (reusable())
+        {
+            loop.remove(serv);
+            pool.put(servkey, serv);
+            serv = -1;
+        }
+        else
+            closeserv();
+
+        if (banned(res.data)) // bad content
+        {
+            res = response(302, "Page Moved", BADCONTENT);
+            res.header["Location"] = ERROR2URL;
+        }
+
+        if (!res.header.count("Content-Length")) // the server might not have sent a C-L header, but we need one so the client can read >1 responses.
+            res.header["Content-Length"] = tostring(res.data.length());
+
+        else if (!res.head && atoi(res.header["Content-Length"].c_str()) != (int)res.data.length())
+                error("content-length mismatch"); // this should never happen, httpmessage checks it
+
+        respond(0);
+    }
+
+    // something went wrong talking to the server. send the client an error instead
+    void fail(int code, string reason, string data)
+    {
+        closeserv();
+        res = response(code, reason, data);
+        respond(0);
+    }
+
+    // res is ready, start sending it to the client
+    void respond(int r)
+    {
+        res.header["Proxy-Connection"] = "close";
+        res.header["Connection"] = "close";
+        keepalive = 0;
+
+        if (r != -1 && (req.header["Connection"] == "keep-alive" || req.header["Proxy-Connection"] == "keep-alive"))
+        {
+            res.header["Proxy-Connection"] = "keep-alive";
+            res.header["Connection"] = "keep-alive";
+            keepalive = 1;
+        }
+
+        if (debug>=2) printf("PROXY->CLIENT:\n\n%s\n\n", res.render().c_str());
+        out     = res.render();
+        outpos  = 0;
+        state   = WRITING;
+        writeclient();
+    }
+
+    // write the response to the client. then go back to reading the next request
+    void writeclient()
+    {
+        int r = flush(sock);
+        if (r == -1)
+        {
+            finish();
+            return;
+        }
+        if (r == 0) return;
+
+        requests++;
+        if (!keepalive)
+        {
+            finish();
+            return;
+        }
+
+        req     = httprequest();
+        res     = httpresponse();
+        out.erase();
+        outpos  = 0;
+        state   = READING;
+        readclient();
+    }
+
+    // write out[outpos..] to fd. returns 1 when all of it is written, 0 if the
+    // socket is full (try again on the next event), -1 on error
+    int flush(int fd)
+    {
+        while (outpos < out.length())
+        {
+            int r = ::send(fd, out.data()+outpos, out.length()-outpos, MSG_NOSIGNAL);
+            if (r == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            outpos += r;
+        }
+        return 1;
+    }
+
+    // create a custom message
+    httpresponse response(int code, string reason, string data)
+    {
+        httpresponse res;
+        res.http    = "HTTP/1.1";
+        res.code    = tostring(code);
+        res.reason  = reason;
+        res.data    = data;
+        res.header["Content-Length"] = tostring(res.data.length());
+        res.header["Content-Type"] = "text/plain";
+        return res;
+    }
+
+    int banned(string data)
+    {
+        for (unsigned int i=0;i<sizeof(BANNED)/sizeof(char*);i++)
+        {
+            if (strfind(data, BANNED[i]))
+            {
+                if (debug) printf("FOUND: %s\n", BANNED[i]);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+};
+
+
+// accepts new client connections on the listening socket and gives each one a proxyhandler
+class acceptor: public iohandler
+{
+  public:
+    eventloop&  loop;
+    int         listener;
+
+    acceptor(eventloop& l, int s) : loop(l)
+    {
+        listener = s;
+        nonblocking(listener);
+        loop.add(listener, this);
+    }
+
+    void event(int fd, unsigned int events)
+    {
+        while (1)
+        {
+            struct sockaddr_in newaddr;
+            socklen_t size = sizeof newaddr;
+
+            int newsock = accept4(listener, (struct sockaddr *)&newaddr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (newsock == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno == EMFILE || errno == ENFILE)
+                {   // out of file descriptors. the rest wait in the backlog
+                    printf("error: accept: %s\n", strerror(errno));
+                    return;
+                }
+                error("accept");
+            }
+
+            if (debug) printf("connection from %s\n", inet_ntoa(newaddr.sin_addr));
+            new proxyhandler(loop, newsock, newaddr);
+        }
+    }
+};
+
+
+// the old way: fork off a process for every client connection.
+// each child runs its own eventloop with just the one proxyhandler in it.
+int forkmain(int listener)
+{
+    signal(SIGCHLD, SIG_IGN); // don't leave zombies around
+
+    while (1)
+    {
+        socklen_t size = sizeof(sockaddr_in);
+        struct sockaddr_in newaddr;
+
+        int newsock = accept(listener, (struct sockaddr *)&newaddr, &size);
+        if (newsock == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            error("accept");
+        }
+
+        if (debug) printf("connection from %s\n", inet_ntoa(newaddr.sin_addr));
+
+        fflush(stdout);
+        if (!fork())
+        {
+            close(listener);
+            eventloop loop;
+            new proxyhandler(loop, newsock, newaddr);
+            while (loop.connections)
+                loop.once(-1);
+            return 0;
+        }
+        close(newsock);
+    }
+
+    return 0;
+}
+
+
+// create a listening socket on port. with reuseport, several sockets can listen
+// on the same port and the kernel spreads new connections between them.
+int listensocket(int port, int backlog, int reuseport)
+{
+    struct sockaddr_in  addr;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    memset(addr.sin_zero, '\0', sizeof addr.sin_zero);
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (listener == -1)
+        error("create socket");
+
+    int on = 1;
+    if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) == -1)
+        error("SO_REUSEADDR");
+
+    if (reuseport && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) == -1)
+        error("SO_REUSEPORT");
+
+    if (bind(listener, (struct sockaddr *)&addr, sizeof addr) == -1)
+        error("bind");
+
+    if (listen(listener, backlog) == -1)
+        error("listen");
+
+    return listener;
+}
+
+
+// a worker process. it accepts from its own listener and runs its own eventloop
+void worker(int id, int listener, int cpu)
+{
+    prctl(PR_SET_PDEATHSIG, SIGTERM); // go away with the parent
+
+    if (cpu != -1)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof set, &set) == -1)
+            printf("error: could not pin worker %d to cpu %d: %s\n", id, cpu, strerror(errno));
+    }
+
+    if (debug && cpu == -1) printf("worker %d (pid %d) started\n", id, getpid());
+    if (debug && cpu != -1) printf("worker %d (pid %d) started on cpu %d\n", id, getpid(), cpu);
+
+    eventloop loop;
+    acceptor  acc(loop, listener);
+    while (1)
+    {
+        loop.once(1000);
+        pool.expire();
+    }
+}
+
+// fork worker process i. returns its pid
+pid_t spawn(vector<int>& listeners, size_t i, int cpu)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+        error("fork");
+    if (!pid)
+    {
+        for (size_t j=0;j<listeners.size();j++)
+            if (j != i) close(listeners[j]);
+        worker(i, listeners[i], cpu);
+        exit(0);
+    }
+    return pid;
+}
+
+// start a worker process for each listener, and restart any that die.
+// with affinity, worker i is pinned to the i-th cpu we are allowed to run on.
+int workermain(vector<int>& listeners, int affinity)
+{
+    vector<int> cpus;
+    if (affinity)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof set, &set) == -1)
+            error("sched_getaffinity");
+        for (int i=0;i<CPU_SETSIZE;i++)
+            if (CPU_ISSET(i, &set)) cpus.push_back(i);
+    }
+
+    vector<pid_t> pids;
+    for (size_t i=0;i<listeners.size();i++)
+        pids.push_back(spawn(listeners, i, cpus.empty() ? -1 : cpus[i % cpus.size()]));
+
+    while (1)
+    {
+        int st;
+        pid_t pid = wait(&st);
+        if (pid == -1)
+        {
+            if (errno == EINTR) continue;
+            error("wait");
+        }
+        for (size_t i=0;i<pids.size();i++)
+        {
+            if (pids[i] != pid) continue;
+            printf("error: worker %d (pid %d) died (status %d), restarting\n", (int)i, pid, st);
+            pids[i] = spawn(listeners, i, cpus.empty() ? -1 : cpus[i % cpus.size()]);
+        }
+    }
+
+    return 0;
+}
+
+
+// numeric settings that can be changed from the command line with "-name value"
+struct setting
+{
+    const char* name;
+    int*        value;
+};
+
+setting SETTINGS[] = {
+    { "-pool-idle",     &pool.maxidle },
+    { "-pool-host",     &pool.maxperhost },
+    { "-pool-timeout",  &pool.timeout },
+};
+
+// set a numeric setting. returns 0 if there is no such setting
+int set(string name, string value)
+{
+    for (unsigned int i=0;i<sizeof(SETTINGS)/sizeof(setting);i++)
+    {
+        if (name == SETTINGS[i].name)
+        {
+            *SETTINGS[i].value = atoi(value.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// proxy main. listen for and accept new requests, handing them to proxyhandler objects.
+int main(int argv, char**argc)
+{
+    int port        = PORT;
+    string mode     = "epoll";
+    int workers     = 1;
+    int affinity    = 0;
+    int backlog     = 511;
+
+    vector<string> args;
+    for (int i=1;i<argv;i++)
+        args.push_back(argc[i]);
+
+    while (args.size() >= 2)
+    {
+        if (args[0] == "-p")
+        {
+            port = atoi(args[1].c_str());
+            args.erase(args.begin(),args.begin()+2);
+        }
+        else if (args[0] == "-v")
+        {
+            debug = atoi(args[1].c_str());
+            args.erase(args.begin(),args.begin()+2);
+        }
+        else if (args[0] == "-m")
+        {
+            mode = args[1];
+            args.erase(args.begin(),args.begin()+2);
+        }
+        else if (args[0] == "-w")
+        {
+            workers = atoi(args[1].c_str());
+            args.erase(args.begin(),args.begin()+2);
+        }
+        else if (args[0] == "-a")
+        {
+            affinity = atoi(args[1].c_str());
+            args.erase(args.begin(),args.begin()+2);
+        }
+        else if (args[0] == "-b")
+        {
+            backlog = atoi(args[1].c_str());
+            args.erase(args.begin(),args.begin()+2);
+        }
+        else if (set(args[0], args[1]))
+        {
+            args.erase(args.begin(),args.begin()+2);
+        }
+        else
+        {
+            printf("'%s' invalid parameter\n", args[0].c_str());
+            args.erase(args.begin());
+        }
+
+    }
+
+    if (mode != "epoll" && mode != "fork")
+    {
+        printf("'%s' invalid mode, using epoll\n", mode.c_str());
+        mode = "epoll";
+    }
+
+    if (workers < 1)
+        workers = 1;
+    if (mode == "fork" && workers > 1)
+    {
+        printf("-w is ignored in fork mode\n");
+        workers = 1;
+    }
+
+    printf("HTTP Proxy listening on port %d (%s", port, mode.c_str());
+    if (workers > 1) printf(", %d workers", workers);
+    printf(")\n");
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (workers > 1 || affinity)
+    {   // every worker gets its own SO_REUSEPORT listener
+        vector<int> listeners;
+        for (int i=0;i<workers;i++)
+            listeners.push_back(listensocket(port, backlog, 1));
+        return workermain(listeners, affinity);
+    }
+
+    int listener = listensocket(port, backlog, 0);
+
+    if (mode == "fork")
+        return forkmain(listener);
+
+    eventloop loop;
+    acceptor  acc(loop, listener);
+    while (1)
+    {
+        loop.once(1000);
+        pool.expire();
+    }
+
+    return 0;
+}